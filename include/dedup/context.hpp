@@ -2,7 +2,9 @@
 #define DEDUPLICATOR_CONTEXT_HPP_
 
 #include <filesystem>
+#include <functional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "sqlitemm/db.hpp"
@@ -30,18 +32,31 @@ public:
 
   // update info if `file` is not recorded in datebase
   static void update_non_existing(const std::filesystem::path& file);
-  // update info if the last modified time of `file` does not match that in database
-  static void update_modified(const std::filesystem::path& file);
+  // update info if the last modified time of `file` does not match that in database, return the up-to-date info,
+  // no status if it could not be hashed
+  static FileStatus update_modified(const std::filesystem::path& file);
   // update info if the SHA512 digest of `file` does not match that in database
   static void update_different(const std::filesystem::path& file);
-  // query for hash of duplicated files in database
-  [[nodiscard]] static std::vector<SHA512> query_dup_hashes();
-  // same, but only query hashes of those under `parent_dir`
-  [[nodiscard]] static std::vector<SHA512> query_dup_hashes(const std::filesystem::path& parent_dir);
-  // query duplicated files of same size by hash returned by `query_dup_hashes`
-  [[nodiscard]] static std::vector<std::string> query_dup_files_by_hash(const SHA512& hash);
+  // update info of files under `dir` (see `update_modified`), calling `on_file` for each of them, then fingerprint
+  // `dir` bottom-up from types, names, sizes and hashes of its children; no status if any entry under `dir` could
+  // not be read or hashed
+  static FileStatus update_tree(const std::filesystem::path& dir,
+                                const std::function<void(const std::filesystem::path&)>& on_file);
+  // leave files under `dirs`, which are not nested in each other, out of `query_dup_files`
+  static void set_copies(const std::vector<std::string>& dirs);
+  // query groups of duplicated files under `parent_dir`
+  [[nodiscard]] static std::vector<std::vector<std::string>> query_dup_files(const std::filesystem::path& parent_dir);
+  // query groups of duplicated directories under `parent_dir`, fingerprinted by `update_tree`
+  [[nodiscard]] static std::vector<std::vector<std::string>> query_dup_dirs(const std::filesystem::path& parent_dir);
+  // iterate info of files under `parent_dir` in database, ordered by size, hash and path
+  static void each_file_sorted(const std::filesystem::path& parent_dir,
+                               const std::function<void(const FileStatus&)>& callback);
 
 protected:
+  // run `stmt` selecting `dir, size, hash` under `parent_dir` ordered by size and hash, group rows of same size and hash
+  [[nodiscard]] static std::vector<std::vector<std::string>> query_groups(const std::string_view& stmt,
+                                                                        const std::filesystem::path& parent_dir);
+
   /* NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables) */
   static sqlitemm::DB db_;
 };
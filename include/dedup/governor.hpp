@@ -0,0 +1,65 @@
+#ifndef DEDUPLICATOR_DEDUP_GOVERNOR_HPP_
+#define DEDUPLICATOR_DEDUP_GOVERNOR_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+#include "sys/types.h"
+
+namespace dedup {
+
+// throttles reads of the hashing reader so that scans stay in the background
+class Governor {
+public:
+  struct Limits {
+    // bytes read per second, 0 for unlimited
+    std::uint64_t bytes_per_sec{0};
+    // read operations per second, 0 for unlimited
+    std::uint64_t iops{0};
+    // share of one CPU taken by hashing, in (0, 1]
+    double cpu_share{1.0};
+    // back off while average I/O latency of the device (from `/proc/diskstats`) exceeds it, 0 to disable
+    std::uint64_t max_latency_ms{0};
+  };
+
+  static void configure(const Limits& limits);
+
+  // block until reading `bytes` from device `dev` is within the limits
+  static void acquire(const std::uint64_t& bytes, const dev_t& dev);
+
+protected:
+  using Clock = std::chrono::steady_clock;
+
+  struct TokenBucket {
+    double rate{0};
+    double tokens{0};
+    Clock::time_point last;
+
+    // take `n` tokens, return how long to wait for them
+    Clock::duration take(const double& n, const Clock::time_point& now);
+  };
+
+  static Clock::duration cpu_delay(const Clock::time_point& now);
+  static Clock::duration latency_delay(const dev_t& dev, const Clock::time_point& now);
+
+  /* NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables) */
+  static std::mutex mutex_;
+  static Limits limits_;
+  static TokenBucket bytes_;
+  static TokenBucket ios_;
+  // CPU accounting window
+  static Clock::time_point cpu_wall_;
+  static std::int64_t cpu_ns_;
+  // last `/proc/diskstats` sample of the device
+  static Clock::time_point disk_sampled_;
+  static dev_t disk_dev_;
+  static std::uint64_t disk_ios_;
+  static std::uint64_t disk_ms_;
+  static Clock::duration backoff_;
+  /* NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables) */
+};
+
+} // namespace dedup
+
+#endif // DEDUPLICATOR_DEDUP_GOVERNOR_HPP_
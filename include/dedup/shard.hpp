@@ -0,0 +1,85 @@
+#ifndef DEDUPLICATOR_DEDUP_SHARD_HPP_
+#define DEDUPLICATOR_DEDUP_SHARD_HPP_
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "dedup/misc.hpp"
+
+namespace dedup::shard {
+
+// A shard file is the index of files scanned on one node, sorted by (size, hash, path):
+//   header: magic `DDSHARD2`, u32 node name length, node name
+//   record: u64 size, 64 bytes SHA512 digest, u32 path length, path
+// integers are little-endian.
+
+struct Record {
+  std::uintmax_t size{0};
+  SHA512 hash{};
+  std::string node;
+  std::string path;
+};
+
+// order by size, hash, node and path
+bool operator<(const Record& lv, const Record& rv);
+// same size and hash
+bool same_content(const Record& lv, const Record& rv);
+
+class Writer {
+public:
+  Writer(const Writer&) = delete;
+  Writer(Writer&&) noexcept = default;
+  Writer& operator=(const Writer&) = delete;
+  Writer& operator=(Writer&&) noexcept = default;
+
+  Writer(const std::filesystem::path& file, const std::string& node);
+
+  virtual ~Writer() = default;
+
+  // records must be written in order
+  void write(const std::uintmax_t& size, const SHA512& hash, const std::string& path);
+  [[nodiscard]] bool good() const;
+  // flush and close the shard, false if any write failed
+  bool close();
+
+protected:
+  std::ofstream f_;
+};
+
+class Reader {
+public:
+  Reader(const Reader&) = delete;
+  Reader(Reader&&) noexcept = default;
+  Reader& operator=(const Reader&) = delete;
+  Reader& operator=(Reader&&) noexcept = default;
+
+  explicit Reader(const std::filesystem::path& file);
+
+  virtual ~Reader() = default;
+
+  // read the next record into `record`, false at the end of shard or on error
+  bool next(Record& record);
+  [[nodiscard]] bool good() const;
+  [[nodiscard]] const std::string& node() const;
+
+protected:
+  std::filesystem::path file_;
+  std::ifstream f_;
+  std::string node_;
+  Record last_;
+  bool good_{false};
+};
+
+// k-way merge of sorted `shard_files`, for every group of two or more records of same content call `on_begin`, then
+// `on_record` for each record of the group, then `on_end`; only the head of each shard and the first record of the
+// current group are held in memory; fails if two shards carry the same node name
+bool merge(const std::vector<std::filesystem::path>& shard_files, const std::function<void()>& on_begin,
+           const std::function<void(const Record&)>& on_record, const std::function<void()>& on_end);
+
+} // namespace dedup::shard
+
+#endif // DEDUPLICATOR_DEDUP_SHARD_HPP_
@@ -1,21 +1,51 @@
 #ifndef DEDUPLICATOR_DEDUP_SQL_STMTS_HPP_
 #define DEDUPLICATOR_DEDUP_SQL_STMTS_HPP_
 
+#include <cstdint>
 #include <string_view>
 
 namespace dedup::sql {
 
 constexpr const std::string_view CREATE{
   "CREATE TABLE dedup(dir TEXT PRIMARY KEY, size INTEGER, time INTEGER, hash BLOB);"};
+// bumped whenever digests stored in database are no longer comparable to new ones
+constexpr const std::string_view SELECT_VERSION{"PRAGMA user_version;"};
+// followed by `VERSION` and `;`, a pragma takes no bound parameter
+constexpr const std::string_view UPDATE_VERSION{"PRAGMA user_version = "};
+constexpr const std::int64_t VERSION{1};
+constexpr const std::string_view DELETE_ALL{"DELETE FROM dedup;"};
 constexpr const std::string_view SELECT_BY_DIR{"SELECT * FROM dedup WHERE dir == ?;"};
 constexpr const std::string_view SELECT_ALL_NAMES{"SELECT dir FROM dedup;"};
 constexpr const std::string_view INSERT{"INSERT OR REPLACE INTO dedup VALUES (?, ?, ?, ?);"};
 constexpr const std::string_view DELETE_BY_DIR{"DELETE FROM dedup WHERE dir == ?;"};
-constexpr const std::string_view SELECT_DUP_HASH{"SELECT hash FROM dedup GROUP BY hash HAVING count(*) >= 2;"};
-constexpr const std::string_view SELECT_DUP_HASH_UNDER_DIR{
-  "SELECT hash FROM dedup WHERE dir LIKE ? || '%' GROUP BY hash HAVING count(*) >= 2;"};
-constexpr const std::string_view SELECT_DUP_SIZE_BY_HASH{
-  "SELECT dir FROM dedup WHERE size IN (SELECT size FROM dedup WHERE hash == ? GROUP BY size HAVING count(*) >= 2);"};
+constexpr const std::string_view DELETE_UNDER_DIR{"DELETE FROM dedup WHERE dir >= ? AND dir < ?;"};
+constexpr const std::string_view SELECT_SORTED_UNDER_DIR{
+  "SELECT * FROM dedup WHERE dir >= ? AND dir < ? ORDER BY size, hash, dir;"};
+// files under copies of duplicated directories, `[dir/, dir0)` in `dedup_copy`, are left out; the ranges do not
+// overlap, so only the one with the greatest lower bound not after the path can contain it
+constexpr const std::string_view SELECT_DUP_UNDER_DIR{
+  "SELECT d.dir, d.size, d.hash FROM dedup d JOIN (SELECT size, hash FROM dedup f WHERE f.dir >= ?1 AND f.dir < ?2 "
+  "AND coalesce((SELECT hi FROM dedup_copy WHERE lo <= f.dir ORDER BY lo DESC LIMIT 1), '') <= f.dir "
+  "GROUP BY size, hash HAVING count(*) >= 2) g ON d.size == g.size AND d.hash == g.hash "
+  "WHERE d.dir >= ?1 AND d.dir < ?2 "
+  "AND coalesce((SELECT hi FROM dedup_copy WHERE lo <= d.dir ORDER BY lo DESC LIMIT 1), '') <= d.dir "
+  "ORDER BY d.size, d.hash;"};
+
+// fingerprints of directories, computed from names and hashes of their children
+constexpr const std::string_view CREATE_DIR{"CREATE TABLE dedup_dir(dir TEXT PRIMARY KEY, size INTEGER, hash BLOB);"};
+constexpr const std::string_view SELECT_ALL_DIR_NAMES{"SELECT dir FROM dedup_dir;"};
+constexpr const std::string_view INSERT_DIR{"INSERT OR REPLACE INTO dedup_dir VALUES (?, ?, ?);"};
+constexpr const std::string_view DELETE_DIR_BY_DIR{"DELETE FROM dedup_dir WHERE dir == ?;"};
+constexpr const std::string_view DELETE_DIR_UNDER_DIR{"DELETE FROM dedup_dir WHERE dir >= ? AND dir < ?;"};
+constexpr const std::string_view SELECT_DUP_DIR_UNDER_DIR{
+  "SELECT d.dir, d.size, d.hash FROM dedup_dir d JOIN (SELECT size, hash FROM dedup_dir WHERE dir >= ?1 AND dir < ?2 "
+  "GROUP BY size, hash HAVING count(*) >= 2) g ON d.size == g.size AND d.hash == g.hash "
+  "WHERE d.dir >= ?1 AND d.dir < ?2 ORDER BY d.size, d.hash;"};
+
+// copies of duplicated directories, as ranges `[dir/, dir0)` of paths under them
+constexpr const std::string_view CREATE_COPY{"CREATE TEMP TABLE IF NOT EXISTS dedup_copy(lo TEXT PRIMARY KEY, hi TEXT);"};
+constexpr const std::string_view DELETE_ALL_COPIES{"DELETE FROM dedup_copy;"};
+constexpr const std::string_view INSERT_COPY{"INSERT OR REPLACE INTO dedup_copy VALUES (?, ?);"};
 
 } // namespace dedup::sql
 
@@ -1,16 +1,21 @@
 #ifndef DEDUPLICATOR_DEDUP_UTIL_HPP_
 #define DEDUPLICATOR_DEDUP_UTIL_HPP_
 
-#include <filesystem>
-#include <functional>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
 
 namespace dedup::util {
 
-void walk_dir(const std::filesystem::path& dir, const std::function<void(const std::filesystem::path&)>& callback);
-
 // quote a string to be reused as shell input, e.g. `foo'bar` -> `'foo'\''bar'`
 std::string quote(std::string_view str, const char& quote_char = '\'', const char& escape_char = '\\');
 
+// parse a non-negative decimal integer
+std::optional<std::uint64_t> parse_uint(std::string_view str);
+// parse a non-negative integer with an optional binary suffix, e.g. `512`, `64K`, `10M`, `1G`
+std::optional<std::uint64_t> parse_size(std::string_view str);
+
 } // namespace dedup::util
 
 #endif // DEDUPLICATOR_DEDUP_UTIL_HPP_
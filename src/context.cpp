@@ -1,14 +1,19 @@
 #include "dedup/context.hpp"
 
 #include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <exception>
 #include <filesystem>
+#include <functional>
 #include <optional>
 #include <sqlitemm/value.hpp>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include "sqlitemm/db.hpp"
@@ -29,6 +34,17 @@ SHA512 blob2sha512(const sqlitemm::Value::Blob& blob) {
   return sha;
 }
 
+// `[dir/, dir0)` covers exactly the paths under `dir`, since '0' follows '/' in ASCII
+std::pair<std::string, std::string> range_under(const std::filesystem::path& dir) {
+  std::string lower{(dir.is_absolute() ? dir : std::filesystem::absolute(dir)).lexically_normal().string()};
+  if (lower.empty() || lower.back() != '/') {
+    lower.push_back('/');
+  }
+  std::string upper{lower};
+  upper.back() = '0';
+  return {lower, upper};
+}
+
 [[nodiscard]] FileStatus Context::query(const std::filesystem::path& file) {
   FileStatus fs;
   db_.prepare(sql::SELECT_BY_DIR)
@@ -58,6 +74,13 @@ void Context::clean() {
       db_.prepare(sql::DELETE_BY_DIR).bind(1, sqlitemm::Value::of_text(file.c_str())).each_row();
     }
   });
+  db_.exec(sql::SELECT_ALL_DIR_NAMES, [](const std::vector<sqlitemm::Value>& row) -> void {
+    const std::string& dir = row[0].as<sqlitemm::Value::Text>();
+    // a directory replaced by a symbolic link is not walked into anymore
+    if (!std::filesystem::is_directory(std::filesystem::symlink_status(dir))) {
+      db_.prepare(sql::DELETE_DIR_BY_DIR).bind(1, sqlitemm::Value::of_text(dir.c_str())).each_row();
+    }
+  });
 }
 
 void Context::update_non_existing(const std::filesystem::path& file) {
@@ -67,16 +90,20 @@ void Context::update_non_existing(const std::filesystem::path& file) {
   }
 }
 
-void Context::update_modified(const std::filesystem::path& file) {
+FileStatus Context::update_modified(const std::filesystem::path& file) {
   FileStatus status = query(file);
-  if (status.no_status()) {
-    update(FileStatus{file});
-    return;
-  }
-  if (status.time() != FileStatus::time(file)) {
-    update(FileStatus{file});
-    return;
+  if (status.no_status() || status.time() != FileStatus::time(file)) {
+    status = FileStatus{file};
+    if (status.no_status() || status.hash() == SHA512{}) {
+      // failed to hash, do not let it match other failures
+      db_.prepare(sql::DELETE_BY_DIR)
+        .bind(1, sqlitemm::Value::of_text(file.is_absolute() ? file : std::filesystem::absolute(file).lexically_normal()))
+        .each_row();
+      return {};
+    }
+    update(status);
   }
+  return status;
 }
 
 void Context::update_different(const std::filesystem::path& file) {
@@ -92,35 +119,153 @@ void Context::update_different(const std::filesystem::path& file) {
   }
 }
 
-[[nodiscard]] std::vector<SHA512> Context::query_dup_hashes() {
-  std::vector<SHA512> dup_hashes;
-  db_.exec(sql::SELECT_DUP_HASH, [&dup_hashes](const std::vector<sqlitemm::Value>& row) -> void {
-    dup_hashes.emplace_back(blob2sha512(row[0].as<sqlitemm::Value::Blob>()));
-  });
-  return dup_hashes;
+FileStatus Context::update_tree(const std::filesystem::path& dir,
+                                const std::function<void(const std::filesystem::path&)>& on_file) {
+  // children as (name, type, size, hash); the fingerprint covers every entry, so that trees differing in anything
+  // (e.g. an empty directory or a FIFO) never match
+  std::vector<std::tuple<std::string, char, std::uintmax_t, SHA512>> children;
+  bool complete{true};
+  std::error_code ec;
+  for (std::filesystem::directory_iterator it{dir, ec}; !ec && it != std::filesystem::directory_iterator{};
+       it.increment(ec)) {
+    const std::filesystem::path& path = it->path();
+    std::string name = path.filename();
+    std::filesystem::file_type type = it->symlink_status(ec).type();
+    if (ec) {
+      break;
+    }
+    if (type == std::filesystem::file_type::directory) {
+      FileStatus status = update_tree(path, on_file);
+      complete = complete && !status.no_status();
+      children.emplace_back(name, 'd', status.size(), status.hash());
+    } else if (type == std::filesystem::file_type::regular) {
+      on_file(path);
+      FileStatus status = update_modified(path);
+      complete = complete && !status.no_status();
+      children.emplace_back(name, 'f', status.size(), status.hash());
+    } else if (type == std::filesystem::file_type::symlink) {
+      // not followed, but a file linked to is still compared file by file; drop what was recorded when it was a
+      // directory, which would otherwise stay in database as long as the link resolves
+      auto [lower, upper] = range_under(path);
+      db_.prepare(sql::DELETE_DIR_BY_DIR).bind(1, sqlitemm::Value::of_text(path)).each_row();
+      db_.prepare(sql::DELETE_DIR_UNDER_DIR)
+        .bind(1, sqlitemm::Value::of_text(lower))
+        .bind(2, sqlitemm::Value::of_text(upper))
+        .each_row();
+      db_.prepare(sql::DELETE_UNDER_DIR)
+        .bind(1, sqlitemm::Value::of_text(lower))
+        .bind(2, sqlitemm::Value::of_text(upper))
+        .each_row();
+      std::error_code link_ec;
+      if (std::filesystem::is_regular_file(path, link_ec)) {
+        on_file(path);
+        std::ignore = update_modified(path);
+      }
+      std::string target = std::filesystem::read_symlink(path, link_ec);
+      complete = complete && !link_ec;
+      children.emplace_back(name, 'l', 0, sha512(std::vector<std::uint8_t>{target.begin(), target.end()}));
+    } else {
+      char tag = type == std::filesystem::file_type::fifo        ? 'p'
+                 : type == std::filesystem::file_type::socket    ? 's'
+                 : type == std::filesystem::file_type::block     ? 'b'
+                 : type == std::filesystem::file_type::character ? 'c'
+                                                                 : '?';
+      children.emplace_back(name, tag, 0, SHA512{});
+    }
+  }
+  if (ec) {
+    std::ignore = std::fprintf(stderr, "failed to read directory `%s`: %s\n", dir.c_str(), ec.message().c_str());
+    complete = false;
+  }
+
+  FileStatus fs;
+  if (!complete) {
+    // an entry could not be read or hashed, the tree can not be compared
+    db_.prepare(sql::DELETE_DIR_BY_DIR).bind(1, sqlitemm::Value::of_text(dir)).each_row();
+    return fs;
+  }
+  // fingerprint: for each child ordered by name, its type, name, size and hash
+  std::sort(children.begin(), children.end());
+  std::vector<std::uint8_t> data;
+  auto append_u64 = [&data](std::uint64_t value) -> void {
+    for (std::size_t i = 0; i < sizeof(value); ++i) {
+      data.push_back(static_cast<std::uint8_t>(value & 0xFFU));
+      value >>= 8U;
+    }
+  };
+  for (const auto& [name, tag, size, hash] : children) {
+    data.push_back(tag);
+    append_u64(name.size());
+    data.insert(data.end(), name.begin(), name.end());
+    append_u64(size);
+    data.insert(data.end(), hash.begin(), hash.end());
+    fs.size_ += size;
+  }
+  fs.dir_ = dir;
+  fs.hash_ = sha512(data);
+  db_.prepare(sql::INSERT_DIR)
+    .bind(1, sqlitemm::Value::of_text(fs.dir_))
+    .bind(2, sqlitemm::Value::of_integer(static_cast<std::int64_t>(fs.size_)))
+    .bind(3, sqlitemm::Value::of_blob({fs.hash_.begin(), fs.hash_.end()}))
+    .each_row();
+  return fs;
 }
 
-[[nodiscard]] std::vector<SHA512> Context::query_dup_hashes(const std::filesystem::path& parent_dir) {
-  std::vector<SHA512> dup_hashes;
-  db_.prepare(sql::SELECT_DUP_HASH_UNDER_DIR)
-    .bind(1,
-          sqlitemm::Value::of_text(parent_dir.is_absolute()
-                                     ? parent_dir.c_str()
-                                     : std::filesystem::absolute(parent_dir).lexically_normal().c_str()))
-    .each_row([&dup_hashes](const std::vector<sqlitemm::Value>& row) -> void {
-    dup_hashes.emplace_back(blob2sha512(row[0].as<sqlitemm::Value::Blob>()));
+void Context::set_copies(const std::vector<std::string>& dirs) {
+  db_.exec(sql::DELETE_ALL_COPIES);
+  for (const std::string& dir : dirs) {
+    auto [lower, upper] = range_under(dir);
+    db_.prepare(sql::INSERT_COPY)
+      .bind(1, sqlitemm::Value::of_text(lower))
+      .bind(2, sqlitemm::Value::of_text(upper))
+      .each_row();
+  }
+}
+
+[[nodiscard]] std::vector<std::vector<std::string>> Context::query_dup_files(const std::filesystem::path& parent_dir) {
+  return query_groups(sql::SELECT_DUP_UNDER_DIR, parent_dir);
+}
+
+[[nodiscard]] std::vector<std::vector<std::string>> Context::query_dup_dirs(const std::filesystem::path& parent_dir) {
+  return query_groups(sql::SELECT_DUP_DIR_UNDER_DIR, parent_dir);
+}
+
+void Context::each_file_sorted(const std::filesystem::path& parent_dir,
+                               const std::function<void(const FileStatus&)>& callback) {
+  auto [lower, upper] = range_under(parent_dir);
+  db_.prepare(sql::SELECT_SORTED_UNDER_DIR)
+    .bind(1, sqlitemm::Value::of_text(lower))
+    .bind(2, sqlitemm::Value::of_text(upper))
+    .each_row([&callback](const std::vector<sqlitemm::Value>& row) -> void {
+    FileStatus fs;
+    fs.dir_ = row[0].as<sqlitemm::Value::Text>();
+    fs.size_ = row[1].as<sqlitemm::Value::Integer>();
+    fs.time_ = row[2].as<sqlitemm::Value::Integer>();
+    fs.hash_ = blob2sha512(row[3].as<sqlitemm::Value::Blob>());
+    callback(fs);
   });
-  return dup_hashes;
 }
 
-[[nodiscard]] std::vector<std::string> Context::query_dup_files_by_hash(const SHA512& hash) {
-  std::vector<std::string> dup_files;
-  db_.prepare(sql::SELECT_DUP_SIZE_BY_HASH)
-    .bind(1, sqlitemm::Value::of_blob(hash))
-    .each_row([&dup_files](const std::vector<sqlitemm::Value>& row) -> void {
-    dup_files.emplace_back(row[0].as<sqlitemm::Value::Text>());
+[[nodiscard]] std::vector<std::vector<std::string>> Context::query_groups(const std::string_view& stmt,
+                                                                         const std::filesystem::path& parent_dir) {
+  std::vector<std::vector<std::string>> groups;
+  std::int64_t last_size{-1};
+  sqlitemm::Value::Blob last_hash;
+  auto [lower, upper] = range_under(parent_dir);
+  db_.prepare(stmt)
+    .bind(1, sqlitemm::Value::of_text(lower))
+    .bind(2, sqlitemm::Value::of_text(upper))
+    .each_row([&groups, &last_size, &last_hash](const std::vector<sqlitemm::Value>& row) -> void {
+    const std::int64_t& size = row[1].as<sqlitemm::Value::Integer>();
+    const sqlitemm::Value::Blob& hash = row[2].as<sqlitemm::Value::Blob>();
+    if (groups.empty() || size != last_size || hash != last_hash) {
+      groups.emplace_back();
+      last_size = size;
+      last_hash = hash;
+    }
+    groups.back().emplace_back(row[0].as<sqlitemm::Value::Text>());
   });
-  return dup_files;
+  return groups;
 }
 
 /* NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables) */
@@ -151,6 +296,22 @@ sqlitemm::DB Context::db_{[]() -> sqlitemm::DB {
   if (!table_exists) {
     db.exec(sql::CREATE);
   }
+  bool dir_table_exists = std::any_of(table_names.begin(), table_names.end(), [](const std::string& name) -> bool {
+    return name == "dedup_dir";
+  });
+  if (!dir_table_exists) {
+    db.exec(sql::CREATE_DIR);
+  }
+  db.exec(sql::CREATE_COPY);
+  std::int64_t version{0};
+  db.exec(sql::SELECT_VERSION, [&version](const std::vector<sqlitemm::Value>& row) -> void {
+    version = row[0].as<sqlitemm::Value::Integer>();
+  });
+  if (version != sql::VERSION) {
+    // hashes of an older format would never match, drop them to be rehashed
+    db.exec(sql::DELETE_ALL);
+    db.exec(std::string{sql::UPDATE_VERSION} + std::to_string(sql::VERSION) + ";");
+  }
   return db;
 }()};
 
@@ -0,0 +1,173 @@
+#include "dedup/governor.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "sys/sysmacros.h"
+#include "sys/types.h"
+
+namespace dedup {
+
+namespace {
+
+constexpr const std::chrono::milliseconds DISKSTATS_INTERVAL{200};
+constexpr const std::chrono::milliseconds MIN_BACKOFF{10};
+constexpr const std::chrono::milliseconds MAX_BACKOFF{1000};
+
+std::int64_t process_cpu_ns() {
+  timespec ts{};
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return static_cast<std::int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// completed I/Os and milliseconds spent on them by device `dev`
+bool read_diskstats(const dev_t& dev, std::uint64_t& ios, std::uint64_t& ms) {
+  std::ifstream f{"/proc/diskstats"};
+  std::string line;
+  while (std::getline(f, line)) {
+    std::istringstream fields{line};
+    unsigned int dev_major{0};
+    unsigned int dev_minor{0};
+    std::string name;
+    std::uint64_t reads{0};
+    std::uint64_t reads_merged{0};
+    std::uint64_t sectors_read{0};
+    std::uint64_t ms_reading{0};
+    std::uint64_t writes{0};
+    std::uint64_t writes_merged{0};
+    std::uint64_t sectors_written{0};
+    std::uint64_t ms_writing{0};
+    fields >> dev_major >> dev_minor >> name >> reads >> reads_merged >> sectors_read >> ms_reading >> writes >>
+      writes_merged >> sectors_written >> ms_writing;
+    if (fields && dev_major == major(dev) && dev_minor == minor(dev)) {
+      ios = reads + writes;
+      ms = ms_reading + ms_writing;
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+void Governor::configure(const Limits& limits) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Clock::time_point now = Clock::now();
+  limits_ = limits;
+  bytes_ = {static_cast<double>(limits.bytes_per_sec), 0, now};
+  ios_ = {static_cast<double>(limits.iops), 0, now};
+  cpu_wall_ = now;
+  cpu_ns_ = process_cpu_ns();
+  disk_dev_ = 0;
+  backoff_ = Clock::duration::zero();
+}
+
+void Governor::acquire(const std::uint64_t& bytes, const dev_t& dev) {
+  Clock::duration delay{};
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Clock::time_point now = Clock::now();
+    delay = std::max({bytes_.take(static_cast<double>(bytes), now), ios_.take(1, now), cpu_delay(now),
+                      latency_delay(dev, now)});
+  }
+  if (delay > Clock::duration::zero()) {
+    std::this_thread::sleep_for(delay);
+  }
+}
+
+Governor::Clock::duration Governor::TokenBucket::take(const double& n, const Clock::time_point& now) {
+  if (rate <= 0) {
+    return Clock::duration::zero();
+  }
+  // refill, allowing bursts of up to 1/10 second
+  tokens = std::min(tokens + rate * std::chrono::duration<double>(now - last).count(), rate / 10);
+  last = now;
+  // go into debt and wait until it is paid off
+  tokens -= n;
+  if (tokens >= 0) {
+    return Clock::duration::zero();
+  }
+  return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-tokens / rate));
+}
+
+Governor::Clock::duration Governor::cpu_delay(const Clock::time_point& now) {
+  if (limits_.cpu_share >= 1 || limits_.cpu_share <= 0) {
+    return Clock::duration::zero();
+  }
+  std::int64_t cpu_ns = process_cpu_ns();
+  std::chrono::nanoseconds used{cpu_ns - cpu_ns_};
+  Clock::duration allowed =
+    std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(used) / limits_.cpu_share);
+  Clock::duration elapsed = now - cpu_wall_;
+  if (allowed > elapsed) {
+    return allowed - elapsed;
+  }
+  // start a new accounting window once a second
+  if (elapsed >= std::chrono::seconds{1}) {
+    cpu_wall_ = now;
+    cpu_ns_ = cpu_ns;
+  }
+  return Clock::duration::zero();
+}
+
+Governor::Clock::duration Governor::latency_delay(const dev_t& dev, const Clock::time_point& now) {
+  if (limits_.max_latency_ms == 0) {
+    return Clock::duration::zero();
+  }
+  if (dev != disk_dev_) {
+    // devices not in `/proc/diskstats` (e.g. network file systems) are not watched
+    disk_dev_ = dev;
+    disk_sampled_ = now;
+    backoff_ = Clock::duration::zero();
+    if (!read_diskstats(dev, disk_ios_, disk_ms_)) {
+      disk_ios_ = disk_ms_ = 0;
+    }
+    return backoff_;
+  }
+  if (now - disk_sampled_ < DISKSTATS_INTERVAL) {
+    return backoff_;
+  }
+  std::uint64_t ios{0};
+  std::uint64_t ms{0};
+  if (!read_diskstats(dev, ios, ms)) {
+    return backoff_;
+  }
+  // average latency of I/Os completed since last sample
+  if (ios > disk_ios_ && ms >= disk_ms_ && (ms - disk_ms_) > limits_.max_latency_ms * (ios - disk_ios_)) {
+    backoff_ = std::clamp<Clock::duration>(backoff_ * 2, MIN_BACKOFF, MAX_BACKOFF);
+  } else {
+    backoff_ /= 2;
+    if (backoff_ < MIN_BACKOFF) {
+      backoff_ = Clock::duration::zero();
+    }
+  }
+  disk_sampled_ = now;
+  disk_ios_ = ios;
+  disk_ms_ = ms;
+  return backoff_;
+}
+
+/* NOLINTBEGIN(cppcoreguidelines-avoid-non-const-global-variables) */
+std::mutex Governor::mutex_;
+Governor::Limits Governor::limits_;
+Governor::TokenBucket Governor::bytes_;
+Governor::TokenBucket Governor::ios_;
+Governor::Clock::time_point Governor::cpu_wall_;
+std::int64_t Governor::cpu_ns_{0};
+Governor::Clock::time_point Governor::disk_sampled_;
+dev_t Governor::disk_dev_{0};
+std::uint64_t Governor::disk_ios_{0};
+std::uint64_t Governor::disk_ms_{0};
+Governor::Clock::duration Governor::backoff_{};
+/* NOLINTEND(cppcoreguidelines-avoid-non-const-global-variables) */
+
+} // namespace dedup
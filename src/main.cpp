@@ -1,54 +1,219 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <filesystem>
+#include <iterator>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <vector>
 
 #include "dedup/context.hpp"
 #include "dedup/file_status.hpp"
+#include "dedup/governor.hpp"
 #include "dedup/misc.hpp"
+#include "dedup/shard.hpp"
 #include "dedup/util.hpp"
 
 void print_help(const char* command) {
   std::ignore = std::fprintf(stderr,
-                             "Usage: %s <dir>\n"
+                             "Usage: %s [options] <dir>\n"
+                             "       %s [options] export <node> <dir> <shard>\n"
+                             "       %s merge <shard>...\n"
                              "\n"
-                             "  scan duplicated files under <dir>.\n",
-                             command);
+                             "  <dir>                          scan duplicated files under <dir>.\n"
+                             "  export <node> <dir> <shard>    scan <dir> as <node>, write its sorted index to <shard>.\n"
+                             "  merge <shard>...               report duplicated files across the nodes of <shard>s.\n"
+                             "\n"
+                             "Options (limits of hashing, for scanning in the background):\n"
+                             "  --bwlimit=<bytes>[K|M|G]       read at most <bytes> per second.\n"
+                             "  --iops=<n>                     issue at most <n> reads per second.\n"
+                             "  --cpu-share=<percent>          take at most <percent> of one CPU.\n"
+                             "  --max-latency=<ms>             back off while average I/O latency of the device exceeds\n"
+                             "                                 <ms> milliseconds.\n",
+                             command, command, command);
 }
 
-/* NOLINTNEXTLINE(misc-unused-parameters) */
-int main(int argc, const char* argv[]) {
-  if (argc != 2) {
-    print_help(argv[0]);
-    return 1;
-  }
-  std::filesystem::path dir{argv[1]};
-  if (!std::filesystem::is_directory(dir)) {
-    std::ignore = std::fprintf(stderr, "`%s` is not a directory.\n", argv[1]);
-    print_help(argv[1]);
-    return 1;
+// parse leading `--name=value` options into `limits`, return index of the first non-option argument
+std::optional<int> parse_options(int argc, const char* argv[], dedup::Governor::Limits& limits) {
+  int i = 1;
+  for (; i < argc && std::string_view{argv[i]}.substr(0, 2) == "--"; ++i) {
+    std::string_view arg{argv[i]};
+    std::string_view::size_type eq = arg.find('=');
+    std::string_view name = arg.substr(0, eq);
+    std::string_view value_str = eq == std::string_view::npos ? std::string_view{} : arg.substr(eq + 1);
+    // only a size takes a K/M/G suffix, counts, percents and milliseconds do not
+    std::optional<std::uint64_t> value =
+      name == "--bwlimit" ? dedup::util::parse_size(value_str) : dedup::util::parse_uint(value_str);
+    if (!value.has_value()) {
+      std::ignore = std::fprintf(stderr, "Invalid option `%s`.\n", argv[i]);
+      return std::nullopt;
+    }
+    if (name == "--bwlimit") {
+      limits.bytes_per_sec = value.value();
+    } else if (name == "--iops") {
+      limits.iops = value.value();
+    } else if (name == "--cpu-share" && value.value() > 0 && value.value() <= 100) {
+      limits.cpu_share = static_cast<double>(value.value()) / 100;
+    } else if (name == "--max-latency") {
+      limits.max_latency_ms = value.value();
+    } else {
+      std::ignore = std::fprintf(stderr, "Invalid option `%s`.\n", argv[i]);
+      return std::nullopt;
+    }
   }
+  return i;
+}
+
+// scan `dir`, update info of files and fingerprints of directories under it in database, return number of files
+std::size_t scan(const std::filesystem::path& dir) {
   dedup::Context::clean();
-  if (dir.is_relative()) {
-    dir = std::filesystem::absolute(dir).lexically_normal();
-  }
-  dedup::util::walk_dir(dir, [](const std::filesystem::path& file) -> void {
+  std::size_t n_files{0};
+  std::ignore = dedup::Context::update_tree(dir, [&n_files](const std::filesystem::path& file) -> void {
     std::ignore = std::fprintf(stderr, "%s\n", file.c_str());
-    dedup::Context::update_modified(file);
+    ++n_files;
   });
   std::ignore = std::fprintf(stderr, "\n");
-  std::vector<dedup::SHA512> dup_hashes = dedup::Context::query_dup_hashes(dir);
-  for (const dedup::SHA512& dup_hash : dup_hashes) {
-    std::vector<std::string> dup_files = dedup::Context::query_dup_files_by_hash(dup_hash);
-    if (dup_files.empty()) {
-      continue;
+  return n_files;
+}
+
+// if `path` is strictly under any of `dirs`, whose ranges `[dir/, dir0)` do not overlap, sorted by `dir/`
+bool is_under(const std::string& path, const std::vector<std::string>& dirs) {
+  auto it = std::upper_bound(dirs.begin(), dirs.end(), path, [](const std::string& lv, const std::string& rv) -> bool {
+    return lv < rv + '/';
+  });
+  if (it == dirs.begin()) {
+    return false;
+  }
+  const std::string& dir = *std::prev(it);
+  return path.size() > dir.size() && path.compare(0, dir.size(), dir) == 0 && path[dir.size()] == '/';
+}
+
+void print_group(const char* title, const char* rm, const std::vector<std::string>& group) {
+  std::printf("# ========== %s ==========\n", title);
+  for (const std::string& path : group) {
+    std::printf("#%s %s\n", rm, dedup::util::quote(path).c_str());
+  }
+  std::printf("# ================================\n\n");
+}
+
+int report(const std::filesystem::path& dir) {
+  scan(dir);
+  // In each group of identical directories, the first one by path stands for the others (the copies): contents of
+  // the copies are left out, so a copied tree is reported once as a whole rather than file by file. Ordering paths
+  // component by component keeps `a/x` before `b/x` whenever `a` is before `b`, so a group never loses its first
+  // directory to a copy above it.
+  auto path_less = [](const std::string& lv, const std::string& rv) -> bool {
+    return std::filesystem::path{lv} < std::filesystem::path{rv};
+  };
+  std::vector<std::vector<std::string>> dup_dirs = dedup::Context::query_dup_dirs(dir);
+  std::vector<std::string> copies;
+  for (std::vector<std::string>& group : dup_dirs) {
+    std::sort(group.begin(), group.end(), path_less);
+    copies.insert(copies.end(), group.begin() + 1, group.end());
+  }
+  // keep the outermost copies only, everything under a copy follows it in this order
+  std::sort(copies.begin(), copies.end(), path_less);
+  std::vector<std::string> outer_copies;
+  for (std::string& copy : copies) {
+    const std::string* last = outer_copies.empty() ? nullptr : &outer_copies.back();
+    if (last == nullptr || copy.size() <= last->size() || copy.compare(0, last->size(), *last) != 0 ||
+        copy[last->size()] != '/') {
+      outer_copies.emplace_back(std::move(copy));
     }
-    std::printf("# ========== duplicated ==========\n");
-    for (const std::string& dup_file : dup_files) {
-      std::printf("#rm %s\n", dedup::util::quote(dup_file).c_str());
+  }
+  std::sort(outer_copies.begin(), outer_copies.end(), [](const std::string& lv, const std::string& rv) -> bool {
+    return lv + '/' < rv + '/';
+  });
+  dedup::Context::set_copies(outer_copies);
+
+  for (std::vector<std::string>& group : dup_dirs) {
+    group.erase(std::remove_if(group.begin(), group.end(),
+                               [&outer_copies](const std::string& path) -> bool {
+      return is_under(path, outer_copies);
+    }),
+                group.end());
+    if (group.size() >= 2) {
+      print_group("duplicated directories", "rm -r", group);
     }
-    std::printf("# ================================\n\n");
+  }
+  // files under copies are left out by the query itself
+  for (const std::vector<std::string>& group : dedup::Context::query_dup_files(dir)) {
+    print_group("duplicated", "rm", group);
   }
   return 0;
 }
+
+int export_shard(const std::string& node, const std::filesystem::path& dir, const std::filesystem::path& shard_file) {
+  std::size_t n_files = scan(dir);
+  dedup::shard::Writer writer{shard_file, node};
+  if (!writer.good()) {
+    return 1;
+  }
+  std::size_t n_records{0};
+  dedup::Context::each_file_sorted(dir, [&writer, &n_records](const dedup::FileStatus& fs) -> void {
+    writer.write(fs.size(), fs.hash(), fs.dir());
+    ++n_records;
+  });
+  if (!writer.close()) {
+    std::ignore = std::fprintf(stderr, "Failed to write shard `%s`.\n", shard_file.c_str());
+    return 1;
+  }
+  // files that fail to hash are left out, but an empty shard of a non-empty directory would pass for a clean node
+  if (n_files > 0 && n_records == 0) {
+    std::ignore = std::fprintf(stderr, "Failed to write shard `%s`: none of %zu scanned files were indexed.\n",
+                               shard_file.c_str(), n_files);
+    return 1;
+  }
+  return 0;
+}
+
+int merge_shards(const std::vector<std::filesystem::path>& shard_files) {
+  auto on_begin = []() -> void {
+    std::printf("# ========== duplicated ==========\n");
+  };
+  auto on_record = [](const dedup::shard::Record& record) -> void {
+    std::printf("#%s: rm %s\n", record.node.c_str(), dedup::util::quote(record.path).c_str());
+  };
+  auto on_end = []() -> void {
+    std::printf("# ================================\n\n");
+  };
+  return dedup::shard::merge(shard_files, on_begin, on_record, on_end) ? 0 : 1;
+}
+
+/* NOLINTNEXTLINE(misc-unused-parameters) */
+int main(int argc, const char* argv[]) {
+  const char* command = argv[0];
+  dedup::Governor::Limits limits;
+  std::optional<int> first_arg = parse_options(argc, argv, limits);
+  if (!first_arg.has_value()) {
+    print_help(command);
+    return 1;
+  }
+  dedup::Governor::configure(limits);
+  argc -= first_arg.value() - 1;
+  argv += first_arg.value() - 1;
+  if (argc >= 3 && std::string_view{argv[1]} == "merge") {
+    return merge_shards({argv + 2, argv + argc});
+  }
+  bool is_export = argc >= 3 && std::string_view{argv[1]} == "export";
+  if (is_export ? argc != 5 : argc != 2) {
+    print_help(command);
+    return 1;
+  }
+  const char* dir_arg = is_export ? argv[3] : argv[1];
+  std::filesystem::path dir{dir_arg};
+  if (!std::filesystem::is_directory(dir)) {
+    std::ignore = std::fprintf(stderr, "`%s` is not a directory.\n", dir_arg);
+    print_help(command);
+    return 1;
+  }
+  // paths are stored and queried in this form, `/a/./b` or `/a//b` would match nothing
+  dir = std::filesystem::absolute(dir).lexically_normal();
+  if (is_export) {
+    return export_shard(argv[2], dir, argv[4]);
+  }
+  return report(dir);
+}
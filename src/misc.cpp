@@ -1,60 +1,145 @@
 #include "dedup/misc.hpp"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
-#include <fstream>
-#include <ios>
+#include <limits>
 #include <mutex>
 #include <optional>
 #include <string>
 #include <tuple>
 #include <vector>
 
+#include "fcntl.h"
 #include "openssl/crypto.h"
 #include "openssl/evp.h"
 #include "pwd.h"
+#include "sys/stat.h"
+#include "sys/types.h"
 #include "unistd.h"
 
-#define BUF_SIZE 1024
+#include "dedup/governor.hpp"
+
+#define BUF_SIZE (64 * 1024)
 
 namespace dedup {
 
-SHA512 sha512(const std::filesystem::path& file) {
-  if (!std::filesystem::is_regular_file(file)) {
-    std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: not a regular file\n", file.c_str());
-    return {};
+namespace {
+
+// Files are digested block by block in a canonical form that does not depend on their layout on disk:
+//   non-zero block: 'D', block data
+//   run of zeros:   'Z', u64 length in bytes
+//   end:            u64 length of the digested content
+// so holes (found with SEEK_DATA/SEEK_HOLE) are never read, and sparse and dense copies of a file still match.
+constexpr const off_t HASH_BLOCK_SIZE{4096};
+
+void digest_u64(EVP_MD_CTX* md_ctx, std::uint64_t value, bool& ok) {
+  std::uint8_t buf[sizeof(value)];
+  for (std::uint8_t& b : buf) {
+    b = static_cast<std::uint8_t>(value & 0xFFU);
+    value >>= 8U;
   }
-  SHA512 hash;
-  std::ifstream f{file, std::ios::in | std::ios::binary};
-  if (f.bad()) {
-    std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: failed to open.\n", file.c_str());
-    return {};
+  ok = ok && EVP_DigestUpdate(md_ctx, buf, sizeof(buf)) != 0;
+}
+
+void digest_zeros(EVP_MD_CTX* md_ctx, std::uint64_t& zeros, bool& ok) {
+  if (zeros != 0) {
+    ok = ok && EVP_DigestUpdate(md_ctx, "Z", 1) != 0;
+    digest_u64(md_ctx, zeros, ok);
+    zeros = 0;
   }
-  char buf[BUF_SIZE];
-  EVP_MD_CTX* md_ctx = EVP_MD_CTX_new();
-  if (EVP_DigestInit_ex2(md_ctx, EVP_sha512(), nullptr) == 0) {
-    std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: OpenSSL EVP_DigestInit_ex2 failed.\n", file.c_str());
-    EVP_MD_CTX_free(md_ctx);
-    return {};
+}
+
+bool is_zero(const char* data, const std::size_t& len) {
+  return len == 0 || (data[0] == 0 && std::memcmp(data, data + 1, len - 1) == 0);
+}
+
+// digest the first `max_bytes` bytes of `fd` in the canonical form above
+bool digest_extents(EVP_MD_CTX* md_ctx, const int& fd, const std::uintmax_t& max_bytes,
+                    const std::filesystem::path& file) {
+  struct stat st {};
+  if (fstat(fd, &st) != 0) {
+    std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: failed to stat.\n", file.c_str());
+    return false;
   }
-  while (f) {
-    f.read(buf, sizeof(buf));
-    if (EVP_DigestUpdate(md_ctx, buf, f.gcount()) == 0) {
-      std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: OpenSSL EVP_DigestUpdate failed.\n", file.c_str());
-      EVP_MD_CTX_free(md_ctx);
-      return {};
+  off_t end = static_cast<off_t>(std::min<std::uintmax_t>(st.st_size, max_bytes));
+  off_t off{0};
+  std::uint64_t zeros{0};
+  bool seekable{true};
+  bool ok{true};
+  char buf[BUF_SIZE];
+  while (ok && off < end) {
+    // skip whole blocks in the hole before next data
+    off_t data = seekable ? lseek(fd, off, SEEK_DATA) : off;
+    if (data == -1) {
+      if (errno == ENXIO) {
+        data = end; // hole up to the end of file
+      } else {
+        seekable = false; // not supported by the file system
+        data = off;
+      }
+    }
+    off_t hole_end = data >= end ? end : off + (data - off) / HASH_BLOCK_SIZE * HASH_BLOCK_SIZE;
+    zeros += hole_end - off;
+    off = hole_end;
+    if (off >= end) {
+      break;
+    }
+    // read up to next hole, block aligned
+    off_t hole = seekable ? lseek(fd, off, SEEK_HOLE) : -1;
+    off_t data_end = hole == -1 ? end : (hole + HASH_BLOCK_SIZE - 1) / HASH_BLOCK_SIZE * HASH_BLOCK_SIZE;
+    data_end = std::min(std::max(data_end, off + HASH_BLOCK_SIZE), end);
+    while (ok && off < data_end) {
+      std::size_t bytes2read = std::min<off_t>(sizeof(buf), data_end - off);
+      Governor::acquire(bytes2read, st.st_dev);
+      // fill the whole chunk despite short reads, so that blocks stay aligned to file offsets
+      ssize_t bytes_read{0};
+      while (bytes_read < static_cast<ssize_t>(bytes2read)) {
+        ssize_t n = pread(fd, buf + bytes_read, bytes2read - bytes_read, off + bytes_read);
+        if (n == -1 && errno == EINTR) {
+          continue;
+        }
+        if (n == -1) {
+          std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: failed to read.\n", file.c_str());
+          return false;
+        }
+        if (n == 0) {
+          break;
+        }
+        bytes_read += n;
+      }
+      if (bytes_read < static_cast<ssize_t>(bytes2read)) {
+        end = data_end = off + bytes_read; // truncated while hashing
+      }
+      for (ssize_t i = 0; i < bytes_read; i += HASH_BLOCK_SIZE) {
+        std::size_t len = std::min<ssize_t>(HASH_BLOCK_SIZE, bytes_read - i);
+        if (is_zero(buf + i, len)) {
+          zeros += len;
+          continue;
+        }
+        digest_zeros(md_ctx, zeros, ok);
+        ok = ok && EVP_DigestUpdate(md_ctx, "D", 1) != 0 && EVP_DigestUpdate(md_ctx, buf + i, len) != 0;
+      }
+      off += bytes_read;
     }
   }
-  if (EVP_DigestFinal_ex(md_ctx, hash.data(), nullptr) == 0) {
-    std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: OpenSSL EVP_DigestFinal_ex failed.\n", file.c_str());
-    EVP_MD_CTX_free(md_ctx);
-    return {};
+  digest_zeros(md_ctx, zeros, ok);
+  digest_u64(md_ctx, static_cast<std::uint64_t>(off), ok);
+  if (!ok) {
+    std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: OpenSSL EVP_DigestUpdate failed.\n", file.c_str());
   }
-  EVP_MD_CTX_free(md_ctx);
-  return hash;
+  return ok;
+}
+
+} // namespace
+
+SHA512 sha512(const std::filesystem::path& file) {
+  return sha512(file, std::numeric_limits<std::uintmax_t>::max());
 }
 
 SHA512 sha512(const std::filesystem::path& file, const std::uintmax_t& max_bytes) {
@@ -62,11 +147,9 @@ SHA512 sha512(const std::filesystem::path& file, const std::uintmax_t& max_bytes
     std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: not a regular file\n", file.c_str());
     return {};
   }
-  std::uintmax_t bytes_count{0};
   SHA512 hash;
-  char buf[BUF_SIZE];
-  std::ifstream f{file, std::ios::in | std::ios::binary};
-  if (f.bad()) {
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
     std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: failed to open.\n", file.c_str());
     return {};
   }
@@ -74,20 +157,14 @@ SHA512 sha512(const std::filesystem::path& file, const std::uintmax_t& max_bytes
   if (EVP_DigestInit_ex2(md_ctx, EVP_sha512(), nullptr) == 0) {
     std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: OpenSSL EVP_DigestInit_ex2 failed.\n", file.c_str());
     EVP_MD_CTX_free(md_ctx);
+    close(fd);
     return {};
   }
-  while (f && max_bytes > bytes_count) {
-    if (bytes_count + sizeof(buf) <= max_bytes) {
-      f.read(buf, sizeof(buf));
-    } else {
-      f.read(buf, static_cast<std::streamsize>(max_bytes - bytes_count));
-    }
-    bytes_count += f.gcount();
-    if (EVP_DigestUpdate(md_ctx, buf, f.gcount()) == 0) {
-      std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: OpenSSL EVP_DigestUpdate failed.\n", file.c_str());
-      EVP_MD_CTX_free(md_ctx);
-      return {};
-    }
+  bool ok = digest_extents(md_ctx, fd, max_bytes, file);
+  close(fd);
+  if (!ok) {
+    EVP_MD_CTX_free(md_ctx);
+    return {};
   }
   if (EVP_DigestFinal_ex(md_ctx, hash.data(), nullptr) == 0) {
     std::ignore = std::fprintf(stderr, "Failed to hash file `%s`: OpenSSL EVP_DigestFinal_ex failed.\n", file.c_str());
@@ -0,0 +1,223 @@
+#include "dedup/shard.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <ios>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "dedup/misc.hpp"
+
+namespace dedup::shard {
+
+namespace {
+
+// version of the digest format is part of the magic, so shards of different versions are never merged
+constexpr const std::string_view MAGIC{"DDSHARD2"};
+
+template <typename UInt>
+void write_uint(std::ofstream& f, UInt value) {
+  char buf[sizeof(UInt)];
+  for (char& c : buf) {
+    c = static_cast<char>(value & 0xFFU);
+    value >>= 8U;
+  }
+  f.write(buf, sizeof(buf));
+}
+
+template <typename UInt>
+bool read_uint(std::ifstream& f, UInt& value) {
+  unsigned char buf[sizeof(UInt)];
+  if (!f.read(reinterpret_cast<char*>(buf), sizeof(buf))) {
+    return false;
+  }
+  value = 0;
+  for (std::size_t i = sizeof(UInt); i > 0; --i) {
+    value = static_cast<UInt>(value << 8U) | buf[i - 1];
+  }
+  return true;
+}
+
+void write_str(std::ofstream& f, const std::string& str) {
+  write_uint(f, static_cast<std::uint32_t>(str.size()));
+  f.write(str.data(), static_cast<std::streamsize>(str.size()));
+}
+
+bool read_str(std::ifstream& f, std::string& str) {
+  std::uint32_t len{0};
+  if (!read_uint(f, len)) {
+    return false;
+  }
+  str.resize(len);
+  return static_cast<bool>(f.read(str.data(), len));
+}
+
+} // namespace
+
+bool operator<(const Record& lv, const Record& rv) {
+  return std::tie(lv.size, lv.hash, lv.node, lv.path) < std::tie(rv.size, rv.hash, rv.node, rv.path);
+}
+
+bool same_content(const Record& lv, const Record& rv) {
+  return lv.size == rv.size && lv.hash == rv.hash;
+}
+
+Writer::Writer(const std::filesystem::path& file, const std::string& node)
+    : f_(file, std::ios::out | std::ios::binary | std::ios::trunc) {
+  if (!f_) {
+    std::ignore = std::fprintf(stderr, "Failed to open shard `%s` for writing.\n", file.c_str());
+    return;
+  }
+  f_.write(MAGIC.data(), static_cast<std::streamsize>(MAGIC.size()));
+  write_str(f_, node);
+}
+
+void Writer::write(const std::uintmax_t& size, const SHA512& hash, const std::string& path) {
+  write_uint(f_, static_cast<std::uint64_t>(size));
+  f_.write(reinterpret_cast<const char*>(hash.data()), hash.size());
+  write_str(f_, path);
+}
+
+[[nodiscard]] bool Writer::good() const {
+  return f_.good();
+}
+
+bool Writer::close() {
+  f_.flush();
+  bool ok = f_.good();
+  f_.close();
+  return ok && !f_.fail();
+}
+
+Reader::Reader(const std::filesystem::path& file) : file_(file), f_(file, std::ios::in | std::ios::binary) {
+  char magic[MAGIC.size()];
+  if (!f_.read(magic, sizeof(magic)) || std::string_view{magic, sizeof(magic)} != MAGIC) {
+    std::ignore = std::fprintf(stderr, "Failed to read shard `%s`: not a shard file.\n", file_.c_str());
+    return;
+  }
+  if (!read_str(f_, node_)) {
+    std::ignore = std::fprintf(stderr, "Failed to read shard `%s`: truncated header.\n", file_.c_str());
+    return;
+  }
+  last_.node = node_;
+  good_ = true;
+}
+
+bool Reader::next(Record& record) {
+  if (!good_) {
+    return false;
+  }
+  std::uint64_t size{0};
+  if (!read_uint(f_, size)) {
+    // clean end of shard
+    good_ = f_.eof() && f_.gcount() == 0;
+    if (!good_) {
+      std::ignore = std::fprintf(stderr, "Failed to read shard `%s`: truncated record.\n", file_.c_str());
+    }
+    return false;
+  }
+  record.size = size;
+  record.node = node_;
+  if (!f_.read(reinterpret_cast<char*>(record.hash.data()), record.hash.size()) || !read_str(f_, record.path)) {
+    std::ignore = std::fprintf(stderr, "Failed to read shard `%s`: truncated record.\n", file_.c_str());
+    good_ = false;
+    return false;
+  }
+  if (record < last_) {
+    std::ignore = std::fprintf(stderr, "Failed to read shard `%s`: records are not sorted.\n", file_.c_str());
+    good_ = false;
+    return false;
+  }
+  last_ = record;
+  return true;
+}
+
+[[nodiscard]] bool Reader::good() const {
+  return good_;
+}
+
+[[nodiscard]] const std::string& Reader::node() const {
+  return node_;
+}
+
+bool merge(const std::vector<std::filesystem::path>& shard_files, const std::function<void()>& on_begin,
+           const std::function<void(const Record&)>& on_record, const std::function<void()>& on_end) {
+  std::vector<Reader> readers;
+  readers.reserve(shard_files.size());
+  for (const std::filesystem::path& shard_file : shard_files) {
+    readers.emplace_back(shard_file);
+    if (!readers.back().good()) {
+      return false;
+    }
+  }
+  // records of a node passed twice would all be reported as duplicates of themselves
+  for (std::size_t i = 0; i < readers.size(); ++i) {
+    for (std::size_t j = 0; j < i; ++j) {
+      if (readers[i].node() == readers[j].node()) {
+        std::ignore = std::fprintf(stderr, "Failed to merge shards: node `%s` of `%s` already appears in `%s`.\n",
+                                   readers[i].node().c_str(), shard_files[i].c_str(), shard_files[j].c_str());
+        return false;
+      }
+    }
+  }
+
+  // min-heap of the head record of each shard
+  using Head = std::pair<Record, std::size_t>;
+  auto greater = [](const Head& lv, const Head& rv) -> bool {
+    return rv.first < lv.first;
+  };
+  std::priority_queue<Head, std::vector<Head>, decltype(greater)> heads{greater};
+  for (std::size_t i = 0; i < readers.size(); ++i) {
+    Record record;
+    if (readers[i].next(record)) {
+      heads.emplace(std::move(record), i);
+    }
+  }
+
+  // first record of the current group, and if the group has been reported
+  std::optional<Record> first;
+  bool in_group{false};
+  while (!heads.empty()) {
+    Head head = heads.top();
+    heads.pop();
+    if (first.has_value() && same_content(first.value(), head.first)) {
+      if (!in_group) {
+        on_begin();
+        on_record(first.value());
+        in_group = true;
+      }
+      on_record(head.first);
+    } else {
+      if (in_group) {
+        on_end();
+      }
+      first = std::move(head.first);
+      in_group = false;
+    }
+    Record record;
+    if (readers[head.second].next(record)) {
+      heads.emplace(std::move(record), head.second);
+    }
+  }
+  if (in_group) {
+    on_end();
+  }
+
+  for (const Reader& reader : readers) {
+    if (!reader.good()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace dedup::shard
@@ -1,24 +1,14 @@
 #include "dedup/util.hpp"
 
-#include <cstdio>
-#include <filesystem>
-#include <tuple>
+#include <cctype>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
 
 namespace dedup::util {
 
-void walk_dir(const std::filesystem::path& dir, const std::function<void(const std::filesystem::path&)>& callback) {
-  if (!std::filesystem::is_directory(dir)) {
-    std::ignore = std::fprintf(stderr, "failed to walk directory `%s`: not a directory.\n", dir.c_str());
-    return;
-  }
-  for (const std::filesystem::directory_entry& entry : std::filesystem::recursive_directory_iterator{dir}) {
-    if (entry.is_regular_file()) {
-      const std::filesystem::path& file = entry.path();
-      callback(file.is_absolute() ? file : std::filesystem::absolute(file).lexically_normal());
-    }
-  }
-}
-
 std::string quote(std::string_view str, const char& quote_char, const char& escape_char) {
   std::string quoted;
   quoted.reserve(str.length() + 8);
@@ -37,4 +27,45 @@ std::string quote(std::string_view str, const char& quote_char, const char& esca
   return quoted;
 }
 
+std::optional<std::uint64_t> parse_uint(std::string_view str) {
+  if (str.empty()) {
+    return std::nullopt;
+  }
+  std::uint64_t value{0};
+  for (const char& c : str) {
+    auto digit = static_cast<std::uint64_t>(c - '0');
+    if (std::isdigit(static_cast<unsigned char>(c)) == 0 ||
+        value > (std::numeric_limits<std::uint64_t>::max() - digit) / 10) {
+      return std::nullopt;
+    }
+    value = value * 10 + digit;
+  }
+  return value;
+}
+
+std::optional<std::uint64_t> parse_size(std::string_view str) {
+  unsigned int shift{0};
+  switch (str.empty() ? '\0' : std::toupper(static_cast<unsigned char>(str.back()))) {
+  case 'K':
+    shift = 10;
+    break;
+  case 'M':
+    shift = 20;
+    break;
+  case 'G':
+    shift = 30;
+    break;
+  default:
+    break;
+  }
+  if (shift != 0) {
+    str.remove_suffix(1);
+  }
+  std::optional<std::uint64_t> value = parse_uint(str);
+  if (!value.has_value() || value.value() > (std::numeric_limits<std::uint64_t>::max() >> shift)) {
+    return std::nullopt;
+  }
+  return value.value() << shift;
+}
+
 } // namespace dedup::util